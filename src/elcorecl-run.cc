@@ -1,9 +1,15 @@
 // Copyright 2019-2022 RnD Center "ELVEES", JSC
 #include <cstring>
+#include <algorithm>
+#include <chrono>
+#include <climits>
 #include <cstdlib>
 #include <fstream>
+#include <future>
 #include <set>
 #include <sstream>
+#include <stdexcept>
+#include <string>
 #include <vector>
 
 #include <stdio.h>
@@ -15,14 +21,67 @@
 
 #include <elcorecl/elcorecl.h>
 
+#include "elf-inspect.h"
+#include "reduce.h"
+
 bool USE_ALL_CORES = 0;
 
+// Kernel wrappers of elcorecllib and user functions they call
+const struct {
+    const char *name;
+    const char *entry;
+    const char *options;
+} WRAPPERS[] = {
+    {"_elcore_main_wrapper", "main", "without -s and --shmem-layout"},
+    {"_elcorecl_run_wrapper", "main_with_share_mem", "by -s or --shmem-layout"},
+};
+
+struct ShmemLayout {
+    bool enabled = false;
+    size_t common_size = 0;
+    size_t percore_size = 0;
+    size_t align = 64;
+    size_t common_aligned = 0;  // common region padded up to `align`
+    size_t slice_aligned = 0;   // per-core slice padded up to `align`
+    std::string common_init;
+    std::string percore_init;   // file name pattern, `%d` is replaced by core number
+};
+
+struct NDRange {
+    std::vector<size_t> global = {1};
+    std::vector<size_t> local;   // empty means chosen by the runtime
+    std::vector<size_t> offset;  // empty means zero offset
+    bool tune_local = false;     // try candidate local sizes and keep the fastest
+};
+
 void help() {
     printf("Run ElcoreCL kernel on DSP\n");
     printf(" -e <file> \t ELF ElcoreCL kernel file to run (mandatory)\n");
     printf(" -f function \t kernel function\n");
     printf(" -p <platform> \t platform to run kernel, default: 1\n");
     printf(" -s <count> \t size of shared memory in bytes\n");
+    printf(" --shmem-layout=<spec> \t split shared memory into a common region and per-core "
+           "slices, e.g. common=1M,percore=256K,align=64, slice offset and size are appended "
+           "to kernel arguments\n");
+    printf(" --shmem-init=<common|percore>:<file> \t initialize common region or per-core slices "
+           "from file, `%%d` in per-core file name is replaced by core number\n");
+    printf(" --reduce=<sum|min|max|concat>:<float32|int16|int32> \t reduce per-core shared "
+           "memory slices after all cores are finished, requires --shmem-layout\n");
+    printf(" --reduce-output=<file> \t write reduction result to binary file, default: print "
+           "values to stdout\n");
+    printf(" --retry=<n> \t re-enqueue invocations of failed cores on other cores up to <n> "
+           "times\n");
+    printf(" --exclude-failing \t never retry on cores that have already failed\n");
+    printf(" --global=<x[,y,z]> \t global work size of each kernel launch, default: 1\n");
+    printf(" --local=<x[,y,z]|auto> \t local work size, `auto` picks the fastest of power of "
+           "two sizes\n");
+    printf(" --offset=<x[,y,z]> \t global work offset\n");
+    printf(" --keep-debug \t upload ELF with debug sections\n");
+    printf(" --queues-per-core=<k> \t number of command queues created for each core, "
+           "default: 1\n");
+    printf(" --inflight=<k> \t number of independent invocations enqueued on each core at once, "
+           "with <k> > 1 the invocation index is passed as the last argument, default: 1\n");
+    printf(" --out-of-order \t create out-of-order queues if the driver supports them\n");
     printf(" --core=<cores> \t comma separated list of cores or ranges, e.g. 0,4-6,9 "
            "or `all` to select all available cores, default: 0\n");
     printf(
@@ -62,10 +121,21 @@ ecl_int CreateBuffer(ecl_context context, size_t size, ecl_mem &mem, void *p) {
     return ECL_SUCCESS;
 }
 
-void wait_for_sync(const char *file_name) {
+// Unmap `p` and wait until the device sees the host writes, commands on other queues and, with
+// out-of-order queues, on the same queue are not ordered after the unmap otherwise
+ecl_int UnmapBuffer(ecl_command_queue queue, ecl_mem mem, void *p) {
+    ecl_event event;
+    ecl_int result = eclEnqueueUnmapMemObject(queue, mem, p, 0, NULL, &event);
+    if (result != ECL_SUCCESS) return result;
+    result = eclWaitForEvents(1, &event);
+    eclReleaseEvent(event);
+    return result;
+}
+
+void wait_for_sync(const char *file_name, FILE *log) {
     FILE *ready;
 
-    fprintf(stdout, "%s: waiting for sync\n", __func__);
+    fprintf(log, "%s: waiting for sync\n", __func__);
     /* We might lose about 2ms worth of data */
     do {
         /* Sleep for 2ms */
@@ -75,6 +145,252 @@ void wait_for_sync(const char *file_name) {
     fclose(ready);
 }
 
+size_t parse_size(const std::string &str) {
+    // std::stoull silently accepts leading spaces and negates values starting with `-`
+    if (str.empty() || str[0] < '0' || str[0] > '9') throw std::invalid_argument(str);
+    size_t pos = 0;
+    unsigned long long value = std::stoull(str, &pos);
+    std::string suffix = str.substr(pos);
+    int shift = 0;
+    if (suffix == "K" || suffix == "k")
+        shift = 10;
+    else if (suffix == "M" || suffix == "m")
+        shift = 20;
+    else if (suffix == "G" || suffix == "g")
+        shift = 30;
+    else if (!suffix.empty())
+        throw std::invalid_argument(str);
+    if (value > (SIZE_MAX >> shift)) throw std::out_of_range(str);
+    return value << shift;
+}
+
+size_t round_up(size_t value, size_t align) { return ((value + align - 1) / align) * align; }
+
+bool parse_shmem_layout(const std::string str_layout, ShmemLayout &layout) {
+    std::string s;
+    std::istringstream stream(str_layout);
+
+    try {
+        while (getline(stream, s, ',')) {
+            int eq_pos = s.find('=');
+            if (eq_pos == std::string::npos) return false;
+            std::string key = s.substr(0, eq_pos);
+            size_t value = parse_size(s.substr(eq_pos + 1));
+            if (key == "common")
+                layout.common_size = value;
+            else if (key == "percore")
+                layout.percore_size = value;
+            else if (key == "align")
+                layout.align = value;
+            else
+                return false;
+        }
+    } catch (const std::exception &) {
+        return false;
+    }
+    // Slices are placed relative to a page-aligned buffer, so the alignment can not exceed a page
+    if (layout.align == 0 || (layout.align & (layout.align - 1)) != 0 ||
+        layout.align > getpagesize())
+        return false;
+    // Offsets and sizes are passed to the kernel as int32_t
+    if (layout.common_size > INT32_MAX || layout.percore_size > INT32_MAX) return false;
+    layout.common_aligned = round_up(layout.common_size, layout.align);
+    layout.slice_aligned = round_up(layout.percore_size, layout.align);
+    layout.enabled = true;
+    return true;
+}
+
+bool parse_shmem_init(const std::string str_init, ShmemLayout &layout) {
+    int colon_pos = str_init.find(':');
+    if (colon_pos == std::string::npos) return false;
+    std::string region = str_init.substr(0, colon_pos);
+    std::string file_name = str_init.substr(colon_pos + 1);
+    if (file_name.empty()) return false;
+    if (region == "common")
+        layout.common_init = file_name;
+    else if (region == "percore")
+        layout.percore_init = file_name;
+    else
+        return false;
+    return true;
+}
+
+// Replace every `%d` in `pattern` with core number
+std::string percore_file_name(const std::string &pattern, ecl_uint core) {
+    std::string file_name = pattern;
+    std::string number = std::to_string(core);
+    for (size_t pos = file_name.find("%d"); pos != std::string::npos;
+         pos = file_name.find("%d", pos + number.size()))
+        file_name.replace(pos, 2, number);
+    return file_name;
+}
+
+std::string load_shmem_region(const std::string &file_name, char *dst, size_t size) {
+    std::ifstream file(file_name, std::ios::binary | std::ios::ate);
+    if (!file) return "Failed to open " + file_name;
+    size_t file_size = file.tellg();
+    if (file_size > size)
+        return "File " + file_name + " size " + std::to_string(file_size) +
+               " exceeds shared memory region size " + std::to_string(size);
+    file.seekg(0, std::ios::beg);
+    file.read(dst, file_size);
+    return std::string();
+}
+
+// Startup steps below run on worker threads, so they report errors to the caller instead of
+// terminating the program. Building with SERIAL_STARTUP runs them inline where their results
+// are needed, which gives the serial path for timing.
+#ifdef SERIAL_STARTUP
+const std::launch STARTUP_LAUNCH = std::launch::deferred;
+#else
+const std::launch STARTUP_LAUNCH = std::launch::async;
+#endif
+
+// Zero the slice of invocation `work` started on core `core` and fill it from its init file
+std::string reset_shmem_slice(char *shmem_buf, const ShmemLayout &layout, int work,
+                              ecl_uint core) {
+    char *slice = shmem_buf + layout.common_aligned + work * layout.slice_aligned;
+    memset(slice, 0, layout.slice_aligned);
+    if (layout.percore_init.empty()) return std::string();
+    return load_shmem_region(percore_file_name(layout.percore_init, core), slice,
+                             layout.percore_size);
+}
+
+// Zero shared memory and fill regions from init files
+std::string reset_shmem(char *shmem_buf, size_t shmem_size, const ShmemLayout &layout,
+                        const std::vector<ecl_uint> &core_ids, ecl_uint ninvocations) {
+    memset(shmem_buf, 0, shmem_size);
+    std::string error;
+    if (!layout.common_init.empty())
+        error = load_shmem_region(layout.common_init, shmem_buf, layout.common_size);
+    for (int i = 0; error.empty() && layout.enabled && i < ninvocations; ++i)
+        error = reset_shmem_slice(shmem_buf, layout, i, core_ids[i % core_ids.size()]);
+    return error;
+}
+
+// Allocate shared memory, zero it and fill regions from init files
+std::string init_shmem(char *&shmem_buf, size_t shmem_size, const ShmemLayout &layout,
+                       const std::vector<ecl_uint> &core_ids, ecl_uint ninvocations) {
+    shmem_buf = reinterpret_cast<char *>(AllocateAlign(shmem_size));
+    if (shmem_buf == nullptr) return "Failed to create shared buffer";
+    return reset_shmem(shmem_buf, shmem_size, layout, core_ids, ninvocations);
+}
+
+// Size of kernel arguments packed as '\0' separated strings followed by an empty string
+size_t packed_arguments_size(const std::vector<std::string> &kernel_arguments) {
+    size_t size = 0;
+    for (int i = 0; i < kernel_arguments.size(); ++i)
+        size += kernel_arguments[i].size();
+    return size + kernel_arguments.size() + 1;  // '\0' separators
+}
+
+// Pack kernel arguments as '\0' separated strings followed by an empty string
+char *pack_kernel_arguments(const std::vector<std::string> &kernel_arguments, size_t &size) {
+    size = packed_arguments_size(kernel_arguments);
+
+    char *buf = (char *)AllocateAlign(size);
+    if (buf == nullptr) return nullptr;
+    size_t offset = 0;
+    for (int i = 0; i < kernel_arguments.size(); ++i) {
+        memcpy((void *)&buf[offset], kernel_arguments[i].c_str(), kernel_arguments[i].size());
+        offset += kernel_arguments[i].size();
+        buf[offset++] = '\0';
+    }
+    buf[offset] = '\0';  // the final empty string
+    return buf;
+}
+
+struct ElfImage {
+    std::vector<char> data;  // image to upload
+    size_t file_size = 0;
+    ElfInfo info;
+    std::string error;
+};
+
+// Read and validate the ELF, a wrong file or function name is reported without waiting for
+// the upload
+ElfImage load_elf(const char *elf, const char *func_name, bool keep_debug) {
+    ElfImage image;
+    std::ifstream file(elf, std::ios::binary | std::ios::ate);
+    if (!file) {
+        image.error = std::string("Failed to open ") + elf;
+        return image;
+    }
+    image.file_size = file.tellg();
+    image.data.resize(image.file_size);
+    file.seekg(0, std::ios::beg);
+    file.read(image.data.data(), image.file_size);
+
+    const char *elf_error = inspect_elf(image.data, image.info);
+    if (elf_error) {
+        image.error = std::string("Failed to parse ") + elf + ": " + elf_error;
+        return image;
+    }
+    if (image.info.symbols.count(func_name) == 0) {
+        image.error = std::string("Kernel function ") + func_name + " is not found in " + elf;
+        return image;
+    }
+    // The standard wrappers call a user function with the signature selected by options
+    for (auto &wrapper : WRAPPERS) {
+        if (strcmp(func_name, wrapper.name) != 0 || image.info.symbols.count(wrapper.entry))
+            continue;
+        image.error = std::string("Function ") + wrapper.entry + " called by " + wrapper.name +
+                      " is not found in " + elf + ", the wrapper is selected " + wrapper.options;
+        return image;
+    }
+    if (!keep_debug) image.data.swap(image.info.upload);
+    image.info.upload.clear();
+    return image;
+}
+
+double elapsed_ms(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start)
+        .count();
+}
+
+bool parse_dims(const std::string str_dims, std::vector<size_t> &dims) {
+    std::string s;
+    std::istringstream stream(str_dims);
+
+    dims.clear();
+    try {
+        while (getline(stream, s, ','))
+            dims.push_back(parse_size(s));
+    } catch (const std::exception &) {
+        return false;
+    }
+    return dims.size() >= 1 && dims.size() <= 3;
+}
+
+// Local sizes for --local=auto: every combination of power of two divisors of global sizes
+// whose work-group size does not exceed `max_group_size`
+std::vector<std::vector<size_t>> local_candidates(const std::vector<size_t> &global,
+                                                  size_t max_group_size) {
+    std::vector<std::vector<size_t>> candidates = {{}};
+
+    for (size_t dim : global) {
+        std::vector<std::vector<size_t>> next;
+        for (auto &c : candidates) {
+            size_t group_size = 1;
+            for (size_t l : c)
+                group_size *= l;
+            for (size_t l = 1; dim % l == 0 && group_size * l <= max_group_size; l *= 2) {
+                next.push_back(c);
+                next.back().push_back(l);
+            }
+        }
+        candidates.swap(next);
+    }
+    return candidates;
+}
+
+std::string dims_to_string(const std::vector<size_t> &dims) {
+    std::stringstream ss;
+    for (int i = 0; i < dims.size(); ++i)
+        ss << (i ? "," : "") << dims[i];
+    return ss.str();
+}
+
 std::set<ecl_uint> parse_cores(const std::string str_cores) {
     std::set<ecl_uint> cores;
     std::string s;
@@ -105,14 +421,37 @@ int main(int argc, char **argv) {
     int opt, ret;
     int platform = 0;
     ecl_uint ncores;
-    char *func_name, *elf;
+    const char *func_name;
+    char *elf;
     size_t shmem_size = 0;
     elf = NULL;
     func_name = "_elcore_main_wrapper";
     std::set<ecl_uint> cores;
+    ShmemLayout shmem_layout;
+    ReduceSpec reduce;
+    int retry = 0;
+    bool exclude_failing = false;
+    NDRange nd_range;
+    bool keep_debug = false;
+    int queues_per_core = 1;
+    int inflight = 1;
+    bool out_of_order = false;
     static struct option long_options[] = {{"init-sync-file", required_argument, 0, 0},
                                            {"wait-for-file", required_argument, 0, 0},
                                            {"core", optional_argument, 0, 0},
+                                           {"shmem-layout", required_argument, 0, 0},
+                                           {"shmem-init", required_argument, 0, 0},
+                                           {"reduce", required_argument, 0, 0},
+                                           {"reduce-output", required_argument, 0, 0},
+                                           {"retry", required_argument, 0, 0},
+                                           {"exclude-failing", no_argument, 0, 0},
+                                           {"global", required_argument, 0, 0},
+                                           {"local", required_argument, 0, 0},
+                                           {"offset", required_argument, 0, 0},
+                                           {"keep-debug", no_argument, 0, 0},
+                                           {"queues-per-core", required_argument, 0, 0},
+                                           {"inflight", required_argument, 0, 0},
+                                           {"out-of-order", no_argument, 0, 0},
                                            {0, 0, 0, 0}};
     int option_index = 0;
     char *init_sync_file = NULL, *wait_for_file = NULL;
@@ -134,6 +473,57 @@ int main(int argc, char **argv) {
                             error(EXIT_FAILURE, errno, "Failed to parse cores");
                         ncores = cores.size();
                         break;
+                    case 3:
+                        if (!parse_shmem_layout(optarg, shmem_layout))
+                            errx(1, "Failed to parse shared memory layout: %s", optarg);
+                        break;
+                    case 4:
+                        if (!parse_shmem_init(optarg, shmem_layout))
+                            errx(1, "Failed to parse shared memory init: %s", optarg);
+                        break;
+                    case 5:
+                        if (!parse_reduce(optarg, reduce))
+                            errx(1, "Failed to parse reduction: %s", optarg);
+                        break;
+                    case 6:
+                        reduce.output = optarg;
+                        break;
+                    case 7:
+                        retry = atoi(optarg);
+                        if (retry < 0) errx(1, "Wrong number of retries: %s", optarg);
+                        break;
+                    case 8:
+                        exclude_failing = true;
+                        break;
+                    case 9:
+                        if (!parse_dims(optarg, nd_range.global))
+                            errx(1, "Failed to parse global work size: %s", optarg);
+                        break;
+                    case 10:
+                        if (strcmp(optarg, "auto") == 0)
+                            nd_range.tune_local = true;
+                        else if (!parse_dims(optarg, nd_range.local))
+                            errx(1, "Failed to parse local work size: %s", optarg);
+                        break;
+                    case 11:
+                        if (!parse_dims(optarg, nd_range.offset))
+                            errx(1, "Failed to parse global work offset: %s", optarg);
+                        break;
+                    case 12:
+                        keep_debug = true;
+                        break;
+                    case 13:
+                        queues_per_core = atoi(optarg);
+                        if (queues_per_core < 1)
+                            errx(1, "Wrong number of queues per core: %s", optarg);
+                        break;
+                    case 14:
+                        inflight = atoi(optarg);
+                        if (inflight < 1) errx(1, "Wrong number of invocations: %s", optarg);
+                        break;
+                    case 15:
+                        out_of_order = true;
+                        break;
                 }
                 break;
             case 'f':
@@ -157,26 +547,46 @@ int main(int argc, char **argv) {
         }
     }
     if (elf == NULL) errx(1, "Elf file is not specified");
+    // Per-core slices live in shared memory, their offsets and sizes are passed in argv
+    if (shmem_layout.enabled && strcmp(func_name, "_elcore_main_wrapper") == 0)
+        func_name = "_elcorecl_run_wrapper";
+    if (!shmem_layout.enabled && !(shmem_layout.common_init.empty() &&
+                                   shmem_layout.percore_init.empty()))
+        errx(1, "--shmem-init requires --shmem-layout");
+    if (reduce.enabled && !shmem_layout.enabled) errx(1, "--reduce requires --shmem-layout");
+    // Invocations of a core take its queues in turn, queues beyond `inflight` would stay idle
+    if (queues_per_core > inflight) {
+        fprintf(stderr, "Only %d of %d queues per core are used by --inflight=%d, creating %d\n",
+                inflight, queues_per_core, inflight, inflight);
+        queues_per_core = inflight;
+    }
+    // Launch messages move to stderr when stdout carries the reduction result
+    FILE *log = reduce.enabled && reduce.output == "-" ? stderr : stdout;
+    ecl_uint work_dim = nd_range.global.size();
+    if ((!nd_range.local.empty() && nd_range.local.size() != work_dim) ||
+        (!nd_range.offset.empty() && nd_range.offset.size() != work_dim))
+        errx(1, "Dimensions of --global, --local and --offset differ");
+    for (int i = 0; i < work_dim; ++i)
+        if (nd_range.global[i] == 0 || (!nd_range.local.empty() && nd_range.local[i] == 0))
+            errx(1, "Work size can not be zero");
 
+    // Startup is a small task graph: argv is packed on a worker thread until the buffers are
+    // created, the ELF file is loaded and checked while devices are discovered so that a wrong
+    // file is reported before the context is created, and shared memory is prepared during
+    // context creation and program upload. Tasks get copies of what they read.
+    auto startup = std::chrono::steady_clock::now();
     std::vector<std::string> kernel_arguments;
     kernel_arguments.push_back(elf);  // the program name is the first argument
     while (optind < argc)
         kernel_arguments.push_back(argv[optind++]);
-    size_t kernel_arguments_size = 0;
-    for (int i = 0; i < kernel_arguments.size(); ++i)
-        kernel_arguments_size += kernel_arguments[i].size();
-    kernel_arguments_size += kernel_arguments.size() + 1;  // '\0' separators
+    auto args_task = std::async(STARTUP_LAUNCH, [kernel_arguments]() {
+        size_t size = 0;
+        return pack_kernel_arguments(kernel_arguments, size);
+    });
 
-    size_t kernel_arguments_size_aligned = kernel_arguments_size;
-    char *kernel_arguments_aligned = (char *)AllocateAlign(kernel_arguments_size_aligned);
-    size_t offset = 0;
-    for (int i = 0; i < kernel_arguments.size(); ++i) {
-        memcpy((void *)&kernel_arguments_aligned[offset], kernel_arguments[i].c_str(),
-               kernel_arguments[i].size());
-        offset += kernel_arguments[i].size();
-        kernel_arguments_aligned[offset++] = '\0';
-    }
-    kernel_arguments_aligned[offset] = '\0';  // the final empty string
+    auto elf_task = std::async(STARTUP_LAUNCH, [elf, func_name, keep_debug]() {
+        return load_elf(elf, func_name, keep_debug);
+    });
 
     ecl_platform_id platform_ids[2];
     ret = eclGetPlatformIDs(2, &platform_ids[0], nullptr);
@@ -206,31 +616,86 @@ int main(int argc, char **argv) {
     for (auto it = cores.begin(); it != cores.end(); ++it)
         selected_devices.push_back(all_devices[*it]);
     all_devices.clear();
-    printf("ncores=%d ndevs=%d\n", ncores, ndevs);
+    fprintf(log, "ncores=%d ndevs=%d\n", ncores, ndevs);
     if (ndevs < ncores)
         errx(1, "The number of available devices=%d is less than requested=%d", ndevs, ncores);
 
+    ElfImage elf_image = elf_task.get();
+    if (!elf_image.error.empty()) errx(1, "%s", elf_image.error.c_str());
+    // The program is loaded to every selected core, so the smallest memory bounds it. Sizes are
+    // printed without usage if the driver does not report the memory size.
+    ecl_ulong dsp_mem_size = 0;
+    for (auto device : selected_devices) {
+        ecl_ulong mem_size = 0;
+        if (eclGetDeviceInfo(device, ECL_DEVICE_GLOBAL_MEM_SIZE, sizeof(mem_size), &mem_size,
+                             nullptr) != ECL_SUCCESS || mem_size == 0) {
+            dsp_mem_size = 0;
+            break;
+        }
+        if (dsp_mem_size == 0 || mem_size < dsp_mem_size) dsp_mem_size = mem_size;
+    }
+    size_t loadable_size = 0;
+    for (auto &section : elf_image.info.alloc_sections) {
+        if (section.size == 0) continue;
+        loadable_size += section.size;
+        fprintf(stderr, "section %-20s addr=0x%08llx size=%llu", section.name.c_str(),
+                (unsigned long long)section.addr, (unsigned long long)section.size);
+        if (dsp_mem_size)
+            fprintf(stderr, " (%.1f%% of DSP memory)", 100.0 * section.size / dsp_mem_size);
+        fprintf(stderr, "%s\n", section.nobits ? " (not in file)" : "");
+        if (dsp_mem_size && loadable_size > dsp_mem_size)
+            fprintf(stderr,
+                    "Warning: section %s does not fit in DSP memory, %zu of %llu bytes used\n",
+                    section.name.c_str(), loadable_size, (unsigned long long)dsp_mem_size);
+    }
+    fprintf(stderr, "loadable size=%zu", loadable_size);
+    if (dsp_mem_size)
+        fprintf(stderr, " (%.1f%% of %llu bytes of DSP memory)",
+                100.0 * loadable_size / dsp_mem_size, (unsigned long long)dsp_mem_size);
+    fprintf(stderr, " upload size=%zu of %zu\n", elf_image.data.size(), elf_image.file_size);
+
+    // Every core runs `inflight` independent invocations, invocation `i` starts on core
+    // `i % ncores` and has its own argv, retval buffer and shmem slice
+    ecl_uint ninvocations = ncores * inflight;
+    std::vector<ecl_uint> core_ids(cores.begin(), cores.end());
+
+    if (shmem_layout.enabled) {
+        size_t layout_size =
+            shmem_layout.common_aligned + ninvocations * shmem_layout.slice_aligned;
+        if (layout_size > INT32_MAX)
+            errx(1, "Shared memory layout size %zu does not fit in int32_t", layout_size);
+        if (shmem_size != 0 && shmem_size < layout_size)
+            errx(1, "Shared memory size %zu is less than required by layout %zu", shmem_size,
+                 layout_size);
+        if (shmem_size < layout_size) shmem_size = layout_size;
+        fprintf(stderr, "shmem layout: common=%zu percore=%zu align=%zu total=%zu\n",
+                shmem_layout.common_aligned, shmem_layout.slice_aligned, shmem_layout.align,
+                shmem_size);
+    }
+
+    char *shmem_buf = nullptr;
+    std::future<std::string> shmem_task;
+    if (shmem_size) {
+        size_t page_size = getpagesize();
+        shmem_size = ((shmem_size + page_size - 1) / page_size) * page_size;
+        // Only `shmem_buf` is shared with the main thread, which reads it after the join
+        shmem_task = std::async(STARTUP_LAUNCH, [&shmem_buf, shmem_size, shmem_layout, core_ids,
+                                                 ninvocations]() {
+            return init_shmem(shmem_buf, shmem_size, shmem_layout, core_ids, ninvocations);
+        });
+    }
+
     ecl_int result;
     ecl_context context =
         eclCreateContext(nullptr, ncores, &selected_devices[0], nullptr, nullptr, &result);
     if (context == nullptr || result != ECL_SUCCESS)
         errx(1, "Failed to create context. Error code: %d", result);
 
-    std::vector<char> elf_buffer;
     size_t elf_size[ncores];
-    {
-        std::ifstream file(elf, std::ios::binary | std::ios::ate);
-        if (!file) errx(1, "Failed to open %s. Error code: %d", elf, errno);
-        elf_size[0] = file.tellg();
-        file.seekg(0, std::ios::beg);
-        elf_buffer.resize(elf_size[0]);
-        file.read(elf_buffer.data(), elf_size[0]);
-    }
-
     const unsigned char *elfs[ncores];
     for (int i = 0; i < ncores; ++i) {
-        elf_size[i] = elf_size[0];
-        elfs[i] = reinterpret_cast<unsigned char *>(elf_buffer.data());
+        elf_size[i] = elf_image.data.size();
+        elfs[i] = reinterpret_cast<unsigned char *>(elf_image.data.data());
     }
     ecl_program program = eclCreateProgramWithBinary(context, ncores, &selected_devices[0],
                                                      &elf_size[0], &elfs[0], nullptr, &result);
@@ -243,20 +708,48 @@ int main(int argc, char **argv) {
         errx(1, "Failed to create kernel. Error code: %d", result);
 
     ecl_mem shmem_res;
-    char *shmem_buf;
     if (shmem_size) {
-        shmem_buf = reinterpret_cast<char *>(AllocateAlign(shmem_size));
-        memset(shmem_buf, 0, shmem_size);
+        std::string error = shmem_task.get();
+        if (!error.empty()) errx(1, "%s", error.c_str());
         CreateBuffer(context, shmem_size, shmem_res, shmem_buf);
-        if ((shmem_buf == nullptr) || (shmem_res == nullptr))
-            errx(1, "Failed to create shared buffer");
+        if (shmem_res == nullptr) errx(1, "Failed to create shared buffer");
     }
 
-    // Create buffer with argc/argv
-    ecl_mem args_res;
-    CreateBuffer(context, kernel_arguments_size_aligned, args_res, kernel_arguments_aligned);
-    if (args_res == nullptr)
-        errx(1, "Failed to create buffer for argc/argv");
+    // Create buffers with argc/argv, each invocation gets its own copy and the packed arguments
+    // are kept to restore the copies after local size tuning
+    char *kernel_arguments_aligned = args_task.get();
+    if (kernel_arguments_aligned == nullptr) errx(1, "Failed to create buffer for argc/argv");
+    // Arguments appended after the user ones: offset and size of the private slice with
+    // --shmem-layout, then the invocation index with several invocations per core
+    auto invocation_arguments = [&](int work) {
+        std::string packed;
+        if (shmem_layout.enabled)
+            packed += std::to_string(shmem_layout.common_aligned +
+                                     work * shmem_layout.slice_aligned) +
+                      '\0' + std::to_string(shmem_layout.percore_size) + '\0';
+        if (inflight > 1) packed += std::to_string(work) + '\0';
+        return packed;
+    };
+    size_t packed_size = packed_arguments_size(kernel_arguments);
+    size_t args_size = packed_size;
+    for (int i = 0; i < ninvocations; ++i)
+        args_size = std::max(args_size, packed_size + invocation_arguments(i).size());
+    auto write_args = [&](char *dst, int work) {
+        std::string packed = invocation_arguments(work);
+        memcpy(dst, kernel_arguments_aligned, packed_size - 1);  // without the final empty string
+        memcpy(dst + packed_size - 1, packed.data(), packed.size());
+        dst[packed_size - 1 + packed.size()] = '\0';
+    };
+    ecl_mem args_res[ninvocations];
+    for (int i = 0; i < ninvocations; ++i) {
+        char *args = (char *)AllocateAlign(args_size);
+        if (args == nullptr) errx(1, "Failed to create buffer for argc/argv");
+        write_args(args, i);
+        CreateBuffer(context, args_size, args_res[i], args);
+        if (args_res[i] == nullptr)
+            errx(1, "Failed to create buffer for argc/argv");
+    }
+    fprintf(stderr, "startup time=%.3f ms\n", elapsed_ms(startup));
 
     if (init_sync_file) {
         std::stringstream ss;
@@ -265,78 +758,304 @@ int main(int argc, char **argv) {
     }
 
     if (wait_for_file) {
-        wait_for_sync(wait_for_file);
+        wait_for_sync(wait_for_file, log);
     }
 
-    ecl_event kernel_event[ncores];
-    ecl_command_queue queue[ncores];
-    ecl_mem retvals_res[ncores];
-    ecl_uint *retvals[ncores];
+    ecl_event kernel_event[ninvocations];
+    ecl_command_queue queue[ncores * queues_per_core];
+    ecl_mem retvals_res[ninvocations];
+    ecl_uint *retvals[ninvocations];
     size_t retval_size = sizeof(ecl_uint);
-    for (int i = 0; i < ncores; ++i) {
+    for (int i = 0; i < ninvocations; ++i) {
         retvals[i] = reinterpret_cast<ecl_uint *>(AllocateAlign(retval_size));
         *retvals[i] = 0;
         CreateBuffer(context, retval_size, retvals_res[i], retvals[i]);
         if ((retvals[i] == nullptr) || (retvals_res[i] == nullptr))
             errx(1, "Failed to create retval buffer");
     }
-    printf("run");
-    auto core_num = cores.begin();
-    for (int i = 0; i < ncores; ++i, ++core_num) {
-        printf(" %d", *core_num);
-        queue[i] = eclCreateCommandQueueWithProperties(context, selected_devices[i], nullptr,
-                                                       &result);
+    // Queues of core `dev` are queue[dev * queues_per_core + q]
+    const ecl_queue_properties out_of_order_properties[] = {
+        ECL_QUEUE_PROPERTIES, ECL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE, 0};
+    for (int i = 0; i < ncores * queues_per_core; ++i) {
+        ecl_device_id device = selected_devices[i / queues_per_core];
+        queue[i] = nullptr;
+        if (out_of_order) {
+            queue[i] = eclCreateCommandQueueWithProperties(context, device,
+                                                           out_of_order_properties, &result);
+            if (queue[i] == nullptr || result != ECL_SUCCESS) {
+                fprintf(stderr, "Out-of-order queues are not supported, using in-order ones\n");
+                out_of_order = false;
+            }
+        }
+        if (!out_of_order)
+            queue[i] = eclCreateCommandQueueWithProperties(context, device, nullptr, &result);
         if (queue[i] == nullptr || result != ECL_SUCCESS)
-            errx(1, "Failed to create queue for device %d. Error code: %d", *core_num, result);
+            errx(1, "Failed to create queue for device %d. Error code: %d",
+                 core_ids[i / queues_per_core], result);
+    }
 
+    // Invocation `work` owns argv, retval buffer and shmem slice `work`, it runs on core `dev`
+    // which differs from `work % ncores` only when the invocation is retried
+    std::vector<int> work_device(ninvocations);
+    auto work_queue = [&](int work) {
+        return queue[work_device[work] * queues_per_core + (work / ncores) % queues_per_core];
+    };
+    auto enqueue = [&](int work, int dev) {
+        ecl_uint core = core_ids[dev];
         ecl_uint iarg = 0;
         // Pass buffer with user arguments
-        ret = eclSetKernelArgELcoreMem(kernel, iarg++, args_res);
+        ret = eclSetKernelArgELcoreMem(kernel, iarg++, args_res[work]);
         if (ret != ECL_SUCCESS)
-            errx(1, "Failed to set %d arg for device %d. Error code: %d", iarg - 1,
-                 *core_num, ret);
+            errx(1, "Failed to set %d arg for device %d. Error code: %d", iarg - 1, core, ret);
         // Pass retval buffer
-        ret = eclSetKernelArgELcoreMem(kernel, iarg++, retvals_res[i]);
+        ret = eclSetKernelArgELcoreMem(kernel, iarg++, retvals_res[work]);
         if (ret != ECL_SUCCESS)
-            errx(1, "Failed to set %d arg for device %d. Error code: %d", iarg - 1,
-                 *core_num, ret);
+            errx(1, "Failed to set %d arg for device %d. Error code: %d", iarg - 1, core, ret);
 
         if (shmem_size) {
             ret = eclSetKernelArgELcoreMem(kernel, iarg++, shmem_res);
             if (ret != ECL_SUCCESS)
-                errx(1, "Failed to set %d arg for device %d. Error code: %d", iarg - 1, *core_num,
+                errx(1, "Failed to set %d arg for device %d. Error code: %d", iarg - 1, core,
                      ret);
             ret = eclSetKernelArg(kernel, iarg++, sizeof(int32_t), &shmem_size);
             if (ret != ECL_SUCCESS)
-                errx(1, "Failed to set %d arg for device %d. Error code: %d", iarg - 1, *core_num,
+                errx(1, "Failed to set %d arg for device %d. Error code: %d", iarg - 1, core,
                      ret);
         }
 
-        const size_t global_work_size[1] = {1};
-        ret = eclEnqueueNDRangeKernel(queue[i], kernel, 1, nullptr, global_work_size, nullptr, 0,
-                                      nullptr, kernel_event + i);
+        work_device[work] = dev;
+        ret = eclEnqueueNDRangeKernel(work_queue(work), kernel, work_dim,
+                                      nd_range.offset.empty() ? nullptr : &nd_range.offset[0],
+                                      &nd_range.global[0],
+                                      nd_range.local.empty() ? nullptr : &nd_range.local[0], 0,
+                                      nullptr, kernel_event + work);
+        return ret;
+    };
+
+    // Read the result of invocation `work` and reset its retval for a possible retry
+    std::vector<ecl_uint> work_retval(ninvocations, 0);
+    auto succeeded = [&](int work) {
+        ecl_int status = ECL_COMPLETE;
+        ret = eclGetEventInfo(kernel_event[work], ECL_EVENT_COMMAND_EXECUTION_STATUS,
+                              sizeof(status), &status, nullptr);
+        if (ret != ECL_SUCCESS) errx(1, "Failed to get event status. Error code: %d", ret);
+        void *p = eclEnqueueMapBuffer(work_queue(work), retvals_res[work], ECL_TRUE,
+                                      ECL_MAP_READ | ECL_MAP_WRITE, 0, retval_size, 0, NULL, NULL,
+                                      &result);
+        if (p == nullptr || result != ECL_SUCCESS)
+            errx(1, "Failed to map retval buffer. Error code: %d", result);
+        work_retval[work] = *retvals[work];
+        *retvals[work] = 0;
+        ret = UnmapBuffer(work_queue(work), retvals_res[work], p);
+        if (ret != ECL_SUCCESS) errx(1, "Failed to unmap retval buffer. Error code: %d", ret);
+        // A kernel terminated abnormally may leave no retval
+        if (status < 0 && work_retval[work] == 0) work_retval[work] = 1;
+        return work_retval[work] == 0;
+    };
+
+    // Restore shared memory to its initial contents on the host, the whole buffer if `work` is
+    // negative or the slice of invocation `work` otherwise, through the queue that runs it next
+    auto restore_shmem = [&](int work) {
+        ecl_command_queue q = work < 0 ? queue[0] : work_queue(work);
+        char *p = reinterpret_cast<char *>(eclEnqueueMapBuffer(
+            q, shmem_res, ECL_TRUE, ECL_MAP_WRITE, 0, shmem_size, 0, NULL, NULL, &result));
+        if (p == nullptr || result != ECL_SUCCESS)
+            errx(1, "Failed to map shared buffer. Error code: %d", result);
+        std::string error =
+            work < 0 ? reset_shmem(p, shmem_size, shmem_layout, core_ids, ninvocations)
+                     : reset_shmem_slice(p, shmem_layout, work, core_ids[work % ncores]);
+        if (!error.empty()) errx(1, "%s", error.c_str());
+        ret = UnmapBuffer(q, shmem_res, p);
+        if (ret != ECL_SUCCESS) errx(1, "Failed to unmap shared buffer. Error code: %d", ret);
+    };
+
+    // Restore argc/argv of invocation `work` which the kernel may have changed
+    auto restore_args = [&](int work) {
+        char *p = reinterpret_cast<char *>(eclEnqueueMapBuffer(
+            work_queue(work), args_res[work], ECL_TRUE, ECL_MAP_WRITE, 0, args_size, 0, NULL, NULL,
+            &result));
+        if (p == nullptr || result != ECL_SUCCESS)
+            errx(1, "Failed to map argc/argv buffer. Error code: %d", result);
+        write_args(p, work);
+        ret = UnmapBuffer(work_queue(work), args_res[work], p);
+        if (ret != ECL_SUCCESS) errx(1, "Failed to unmap argc/argv buffer. Error code: %d", ret);
+    };
+
+    if (nd_range.tune_local) {
+        // Candidates larger than any selected device accepts would only be rejected
+        size_t max_group_size = SIZE_MAX;
+        for (auto device : selected_devices) {
+            size_t device_max = 0;
+            ret = eclGetDeviceInfo(device, ECL_DEVICE_MAX_WORK_GROUP_SIZE, sizeof(device_max),
+                                   &device_max, nullptr);
+            if (ret != ECL_SUCCESS)
+                errx(1, "Failed to get maximum work-group size. Error code: %d", ret);
+            max_group_size = std::min(max_group_size, device_max);
+        }
+
+        // Launch on all selected cores and return the wall time in seconds, or a negative
+        // value if the runtime or the kernel rejected the launch
+        auto time_launch = [&]() {
+            auto start = std::chrono::steady_clock::now();
+            int nlaunched = 0;
+            while (nlaunched < ncores && enqueue(nlaunched, nlaunched) == ECL_SUCCESS)
+                ++nlaunched;
+            if (nlaunched) eclWaitForEvents(nlaunched, kernel_event);
+            std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+            bool ok = nlaunched == ncores;
+            for (int i = 0; i < nlaunched; ++i) {
+                ok = succeeded(i) && ok;
+                eclReleaseEvent(kernel_event[i]);
+            }
+            return ok ? elapsed.count() : -1.0;
+        };
+
+        // Every candidate runs on all selected cores, the kernel must tolerate repeated runs
+        const int tune_runs = 3;
+        double best_time = -1;
+        std::vector<size_t> best_local;
+        for (auto &local : local_candidates(nd_range.global, max_group_size)) {
+            nd_range.local = local;
+            double time = time_launch();
+            for (int run = 1; run < tune_runs && time >= 0; ++run) {
+                double t = time_launch();
+                time = t < 0 ? t : std::min(time, t);
+            }
+            if (time < 0) {
+                fprintf(stderr, "local=%s: failed\n", dims_to_string(local).c_str());
+                continue;
+            }
+            fprintf(stderr, "local=%s: %.3f ms\n", dims_to_string(local).c_str(), time * 1e3);
+            if (best_time < 0 || time < best_time) {
+                best_time = time;
+                best_local = local;
+            }
+        }
+        if (best_local.empty()) errx(1, "No local work size suits the kernel");
+        nd_range.local = best_local;
+        fprintf(stderr, "selected local=%s\n", dims_to_string(best_local).c_str());
+
+        // The main launch starts from the initial state, retvals are reset by succeeded(). Each
+        // restore waits for its unmap, so no launch below can overtake it.
+        for (int i = 0; i < ncores; ++i)
+            restore_args(i);
+        if (shmem_size) restore_shmem(-1);
+    }
+
+    fprintf(log, "run");
+    for (int i = 0; i < ninvocations; ++i) {
+        if (i < ncores) fprintf(log, " %d", core_ids[i]);
+        ret = enqueue(i, i % ncores);
         if (ret != ECL_SUCCESS)
-            errx(1, "Failed to enqueued kernel for device %d. Error code: %d", *core_num, ret);
+            errx(1, "Failed to enqueued kernel for device %d. Error code: %d",
+                 core_ids[i % ncores], ret);
+    }
+    if (inflight > 1)
+        fprintf(log, " and wait all %d invocations on %d cores\n", ninvocations, ncores);
+    else
+        fprintf(log, " and wait all %d cores\n", ncores);
+    // With retries a failed kernel is reported by its event status instead
+    ret = eclWaitForEvents(ninvocations, kernel_event);
+    if (ret != ECL_SUCCESS && retry == 0)
+        errx(1, "Failed to wait for event. Error code: %d", ret);
+
+    std::vector<int> failures(ncores, 0);
+    std::vector<int> failed_works;
+    for (int i = 0; i < ninvocations; ++i)
+        if (!succeeded(i)) failed_works.push_back(i);
+    for (int work : failed_works)
+        ++failures[work_device[work]];
+
+    int next_dev = 0;
+    for (int attempt = 1; attempt <= retry && !failed_works.empty(); ++attempt) {
+        std::vector<bool> failed_now(ncores, false);
+        for (int work : failed_works)
+            failed_now[work_device[work]] = true;
+
+        // Healthy cores are those that did not fail in this round or, with --exclude-failing,
+        // ever
+        std::vector<int> healthy;
+        for (int dev = 0; dev < ncores; ++dev)
+            if (!failed_now[dev] && !(exclude_failing && failures[dev] > 0))
+                healthy.push_back(dev);
+        if (healthy.empty()) {
+            fprintf(stderr, "No healthy cores left to retry failed invocations\n");
+            break;
+        }
+
+        // A retried invocation starts from its initial slice, not from what the failed run left.
+        // Slices are restored before any retry is enqueued, so no map waits for a retry.
+        fprintf(stderr, "retry %d:", attempt);
+        for (int work : failed_works) {
+            int dev = healthy[next_dev++ % healthy.size()];
+            fprintf(stderr, " %d->%d", core_ids[work_device[work]], core_ids[dev]);
+            work_device[work] = dev;
+            if (shmem_layout.enabled) restore_shmem(work);
+        }
+        fprintf(stderr, "\n");
+
+        std::vector<ecl_event> retry_events;
+        for (int work : failed_works) {
+            int dev = work_device[work];
+            eclReleaseEvent(kernel_event[work]);
+            ret = enqueue(work, dev);
+            if (ret != ECL_SUCCESS)
+                errx(1, "Failed to enqueued kernel for device %d. Error code: %d", core_ids[dev],
+                     ret);
+            retry_events.push_back(kernel_event[work]);
+        }
+        eclWaitForEvents(retry_events.size(), retry_events.data());
+
+        std::vector<int> still_failed;
+        for (int work : failed_works)
+            if (!succeeded(work)) still_failed.push_back(work);
+        for (int work : still_failed)
+            ++failures[work_device[work]];
+        failed_works.swap(still_failed);
+    }
+
+    if (retry) {
+        for (int dev = 0; dev < ncores; ++dev)
+            if (failures[dev])
+                fprintf(stderr, "core %d failed %d time(s)\n", core_ids[dev], failures[dev]);
+        for (int work : failed_works)
+            fprintf(stderr, "invocation %d failed with retval %u\n", work, work_retval[work]);
+    }
+
+    char *shmem_ptr = nullptr;
+    if (reduce.enabled) {
+        shmem_ptr = reinterpret_cast<char *>(eclEnqueueMapBuffer(
+            queue[0], shmem_res, ECL_TRUE, ECL_MAP_READ, 0, shmem_size, 0, NULL, NULL, &result));
+        if (shmem_ptr == nullptr || result != ECL_SUCCESS)
+            errx(1, "Failed to map shared buffer. Error code: %d", result);
     }
-    printf(" and wait all %d cores\n", ncores);
-    ret = eclWaitForEvents(ncores, kernel_event);
-    if (ret != ECL_SUCCESS) errx(1, "Failed to wait for event. Error code: %d", ret);
 
-    core_num = cores.begin();
-    for (int i = 0; i < ncores; ++i, ++core_num) {
-        eclEnqueueMapBuffer(queue[i], retvals_res[i], ECL_TRUE, ECL_MAP_READ, 0,
-                            retval_size, 0, NULL, NULL, &result);
+    for (int i = 0; i < ninvocations; ++i)
+        eclReleaseEvent(kernel_event[i]);
+    for (int i = 0; i < ncores * queues_per_core; ++i) {
         ret = eclReleaseCommandQueue(queue[i]);
         if (ret != ECL_SUCCESS) errx(1, "Failed to release queue. Error code: %d", ret);
     }
 
+    if (reduce.enabled) {
+        // Partial results of failed cores are meaningless, leave them unreduced
+        if (!failed_works.empty())
+            fprintf(stderr, "Reduction skipped: some cores returned nonzero value\n");
+        else if (!run_reduce(reduce, shmem_ptr + shmem_layout.common_aligned,
+                             shmem_layout.slice_aligned, ninvocations,
+                             shmem_layout.percore_size))
+            errx(1, "Failed to write reduction result to %s", reduce.output.c_str());
+    }
+
     if (shmem_size) {
         ret = eclReleaseMemObject(shmem_res);
         if (ret != ECL_SUCCESS) errx(1, "Failed to release resource. Error code: %d", ret);
     }
 
-    ret = eclReleaseMemObject(args_res);
-    if (ret != ECL_SUCCESS) errx(1, "Failed to release resource. Error code: %d", ret);
+    for (int i = 0; i < ninvocations; ++i) {
+        ret = eclReleaseMemObject(args_res[i]);
+        if (ret != ECL_SUCCESS) errx(1, "Failed to release resource. Error code: %d", ret);
+    }
 
     ret = eclReleaseKernel(kernel);
     if (ret != ECL_SUCCESS) errx(1, "Failed to release kernel. Error code: %d", ret);
@@ -344,11 +1063,11 @@ int main(int argc, char **argv) {
     if (ret != ECL_SUCCESS) errx(1, "Failed to release program. Error code: %d", ret);
     ret = eclReleaseContext(context);
     if (ret != ECL_SUCCESS) errx(1, "Failed to release context. Error code: %d", ret);
+    free(kernel_arguments_aligned);
 
-    for (int i = 0; i < ncores; ++i) {
-        if (*retvals[i] != 0) return *retvals[i];
+    for (int i = 0; i < ninvocations; ++i) {
         ret = eclReleaseMemObject(retvals_res[i]);
         if (ret != ECL_SUCCESS) errx(1, "Failed to release resource. Error code: %d", ret);
     }
-    return 0;
+    return failed_works.empty() ? 0 : work_retval[failed_works[0]];
 }
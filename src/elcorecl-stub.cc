@@ -0,0 +1,294 @@
+// Copyright 2019-2022 RnD Center "ELVEES", JSC
+// Host-only ElcoreCL backend for timing elcorecl-run startup and testing it without DSP.
+// Driver latencies are emulated with sleeps and kernels are executed at enqueue.
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <stdio.h>
+
+#include <unistd.h>
+
+#include <elcorecl/elcorecl.h>
+
+// Stub objects, the handles of the real library are opaque
+struct _ecl_device_id {
+    ecl_uint index;
+    int runs;
+};
+
+struct _ecl_command_queue {
+    _ecl_device_id *device;
+    bool out_of_order;
+    std::vector<std::shared_ptr<bool>> unmaps;  // completion flags of enqueued unmaps
+};
+
+struct _ecl_mem {
+    char *host_ptr;
+    size_t size;
+    void(ECL_CALLBACK *destructor)(ecl_mem, void *);
+    void *user_data;
+    _ecl_command_queue *unmap_queue;  // queue of the last unmap
+    std::shared_ptr<bool> unmap_done;
+};
+
+struct _ecl_kernel {
+    std::vector<std::vector<char>> args;
+};
+
+struct _ecl_event {
+    ecl_int status;
+    std::shared_ptr<bool> done;  // set when the host waited for the command
+};
+
+namespace {
+
+const ecl_uint MAX_DEVICES = 64;
+_ecl_device_id devices[MAX_DEVICES];
+
+long env_value(const char *name, long default_value) {
+    const char *value = getenv(name);
+    return value ? atol(value) : default_value;
+}
+
+void delay(const char *name) { usleep(env_value(name, 0) * 1000); }
+
+ecl_uint device_count() {
+    long count = env_value("ELCORECL_STUB_DEVICES", 16);
+    return count < 1 ? 1 : count > MAX_DEVICES ? MAX_DEVICES : count;
+}
+
+ecl_event new_event(ecl_int status) {
+    return new _ecl_event{status, std::make_shared<bool>(false)};
+}
+
+ecl_mem kernel_mem_arg(ecl_kernel kernel, ecl_uint index) {
+    if (index >= kernel->args.size() || kernel->args[index].size() != sizeof(ecl_mem))
+        return nullptr;
+    ecl_mem mem;
+    memcpy(&mem, kernel->args[index].data(), sizeof(mem));
+    return mem;
+}
+
+// A kernel may only see host writes of an unmap that was waited for or that precedes it in the
+// same in-order queue
+void check_unmapped(ecl_command_queue queue, ecl_mem mem, const char *name) {
+    if (mem == nullptr || !mem->unmap_done || *mem->unmap_done) return;
+    if (mem->unmap_queue == queue && !queue->out_of_order) return;
+    fprintf(stderr, "stub: kernel on core %u uses %s buffer with an unfinished unmap\n",
+            queue->device->index, name);
+}
+
+}  // namespace
+
+extern "C" {
+
+ecl_int eclGetPlatformIDs(ecl_uint num_entries, ecl_platform_id *platforms,
+                          ecl_uint *num_platforms) {
+    delay("ELCORECL_STUB_PLATFORM_MS");
+    for (ecl_uint i = 0; platforms && i < num_entries; ++i)
+        platforms[i] = nullptr;
+    if (num_platforms) *num_platforms = 1;
+    return ECL_SUCCESS;
+}
+
+ecl_int eclGetDeviceIDs(ecl_platform_id, ecl_device_type, ecl_uint num_entries,
+                        ecl_device_id *ids, ecl_uint *num_devices) {
+    ecl_uint count = device_count();
+    for (ecl_uint i = 0; ids && i < num_entries && i < count; ++i) {
+        devices[i].index = i;
+        ids[i] = &devices[i];
+    }
+    if (num_devices) *num_devices = count;
+    return ECL_SUCCESS;
+}
+
+ecl_int eclGetDeviceInfo(ecl_device_id, ecl_device_info param, size_t size, void *value,
+                         size_t *size_ret) {
+    size_t result;
+    switch (param) {
+        case ECL_DEVICE_MAX_WORK_GROUP_SIZE:
+            result = env_value("ELCORECL_STUB_MAX_WORK_GROUP_SIZE", 1024);
+            if (size_ret) *size_ret = sizeof(size_t);
+            if (value == nullptr) return ECL_SUCCESS;
+            if (size < sizeof(size_t)) return ECL_INVALID_VALUE;
+            memcpy(value, &result, sizeof(size_t));
+            return ECL_SUCCESS;
+        case ECL_DEVICE_GLOBAL_MEM_SIZE: {
+            ecl_ulong mem_size = env_value("ELCORECL_STUB_MEM_SIZE", 512 * 1024);
+            if (size_ret) *size_ret = sizeof(ecl_ulong);
+            if (value == nullptr) return ECL_SUCCESS;
+            if (size < sizeof(ecl_ulong)) return ECL_INVALID_VALUE;
+            memcpy(value, &mem_size, sizeof(ecl_ulong));
+            return ECL_SUCCESS;
+        }
+        default:
+            return ECL_INVALID_VALUE;
+    }
+}
+
+ecl_context eclCreateContext(const ecl_context_properties *, ecl_uint, const ecl_device_id *,
+                             void(ECL_CALLBACK *)(const char *, const void *, size_t, void *),
+                             void *, ecl_int *errcode_ret) {
+    delay("ELCORECL_STUB_CONTEXT_MS");
+    *errcode_ret = ECL_SUCCESS;
+    return reinterpret_cast<ecl_context>(devices);
+}
+
+ecl_program eclCreateProgramWithBinary(ecl_context, ecl_uint, const ecl_device_id *,
+                                       const size_t *, const unsigned char **, ecl_int *,
+                                       ecl_int *errcode_ret) {
+    delay("ELCORECL_STUB_PROGRAM_MS");
+    *errcode_ret = ECL_SUCCESS;
+    return reinterpret_cast<ecl_program>(devices);
+}
+
+ecl_kernel eclCreateKernel(ecl_program, const char *, ecl_int *errcode_ret) {
+    *errcode_ret = ECL_SUCCESS;
+    return new _ecl_kernel;
+}
+
+ecl_mem eclCreateBuffer(ecl_context, ecl_mem_flags, size_t size, void *host_ptr,
+                        ecl_int *errcode_ret) {
+    *errcode_ret = ECL_SUCCESS;
+    return new _ecl_mem{static_cast<char *>(host_ptr), size, nullptr, nullptr, nullptr, nullptr};
+}
+
+ecl_int eclSetMemObjectDestructorCallback(ecl_mem mem, void(ECL_CALLBACK *destructor)(ecl_mem,
+                                                                                       void *),
+                                          void *user_data) {
+    mem->destructor = destructor;
+    mem->user_data = user_data;
+    return ECL_SUCCESS;
+}
+
+ecl_command_queue eclCreateCommandQueueWithProperties(ecl_context, ecl_device_id device,
+                                                      const ecl_queue_properties *properties,
+                                                      ecl_int *errcode_ret) {
+    bool out_of_order = false;
+    for (int i = 0; properties && properties[i]; i += 2)
+        if (properties[i] == ECL_QUEUE_PROPERTIES)
+            out_of_order = properties[i + 1] & ECL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE;
+    if (out_of_order && getenv("ELCORECL_STUB_IN_ORDER_ONLY")) {
+        *errcode_ret = ECL_INVALID_VALUE;
+        return nullptr;
+    }
+    *errcode_ret = ECL_SUCCESS;
+    return new _ecl_command_queue{device, out_of_order, {}};
+}
+
+ecl_int eclSetKernelArgELcoreMem(ecl_kernel kernel, ecl_uint index, ecl_mem mem) {
+    return eclSetKernelArg(kernel, index, sizeof(mem), &mem);
+}
+
+ecl_int eclSetKernelArg(ecl_kernel kernel, ecl_uint index, size_t size, const void *value) {
+    if (kernel->args.size() <= index) kernel->args.resize(index + 1);
+    const char *bytes = static_cast<const char *>(value);
+    kernel->args[index].assign(bytes, bytes + size);
+    return ECL_SUCCESS;
+}
+
+// The kernel stands for _elcorecl_run_wrapper or _elcore_main_wrapper: it returns 0, or 1 on the
+// first run on core ELCORECL_STUB_FAIL_CORE (every run with ELCORECL_STUB_FAIL_ALWAYS), and with
+// shared memory adds core + 1 + i / 2 to float i of the slice whose offset and size are the first
+// two arguments after the program name
+ecl_int eclEnqueueNDRangeKernel(ecl_command_queue queue, ecl_kernel kernel, ecl_uint work_dim,
+                                const size_t *, const size_t *, const size_t *local, ecl_uint,
+                                const ecl_event *, ecl_event *event) {
+    if (local) {
+        size_t group_size = 1;
+        for (ecl_uint i = 0; i < work_dim; ++i)
+            group_size *= local[i];
+        if (group_size > size_t(env_value("ELCORECL_STUB_MAX_WORK_GROUP_SIZE", 1024)))
+            return ECL_INVALID_WORK_GROUP_SIZE;
+    }
+    ecl_mem args = kernel_mem_arg(kernel, 0), retval = kernel_mem_arg(kernel, 1);
+    ecl_mem shmem = kernel_mem_arg(kernel, 2);
+    if (args == nullptr || retval == nullptr) return ECL_INVALID_VALUE;
+    check_unmapped(queue, args, "argv");
+    check_unmapped(queue, retval, "retval");
+    check_unmapped(queue, shmem, "shared");
+
+    std::vector<std::string> argv;
+    for (const char *arg = args->host_ptr; *arg; arg += strlen(arg) + 1)
+        argv.push_back(arg);
+    _ecl_device_id *device = queue->device;
+    bool fail = long(device->index) == env_value("ELCORECL_STUB_FAIL_CORE", -1) &&
+                (device->runs == 0 || getenv("ELCORECL_STUB_FAIL_ALWAYS"));
+    ++device->runs;
+    ecl_uint result = fail ? 1 : 0;
+    memcpy(retval->host_ptr, &result, sizeof(result));
+    if (shmem && argv.size() >= 3) {
+        size_t offset = atol(argv[1].c_str()), size = atol(argv[2].c_str());
+        float *slice = reinterpret_cast<float *>(shmem->host_ptr + offset);
+        for (size_t i = 0; i < size / sizeof(float) && offset + size <= shmem->size; ++i)
+            slice[i] += device->index + 1 + i * 0.5f;
+    }
+    delay("ELCORECL_STUB_KERNEL_MS");
+    *event = new_event(ECL_COMPLETE);
+    return ECL_SUCCESS;
+}
+
+ecl_int eclWaitForEvents(ecl_uint num_events, const ecl_event *events) {
+    for (ecl_uint i = 0; i < num_events; ++i)
+        *events[i]->done = true;
+    return ECL_SUCCESS;
+}
+
+ecl_int eclFinish(ecl_command_queue queue) {
+    for (auto &done : queue->unmaps)
+        *done = true;
+    queue->unmaps.clear();
+    return ECL_SUCCESS;
+}
+
+void *eclEnqueueMapBuffer(ecl_command_queue, ecl_mem mem, ecl_bool, ecl_map_flags, size_t offset,
+                          size_t, ecl_uint, const ecl_event *, ecl_event *event,
+                          ecl_int *errcode_ret) {
+    if (event) *event = new_event(ECL_COMPLETE);
+    *errcode_ret = ECL_SUCCESS;
+    return mem->host_ptr + offset;
+}
+
+ecl_int eclEnqueueUnmapMemObject(ecl_command_queue queue, ecl_mem mem, void *, ecl_uint,
+                                 const ecl_event *, ecl_event *event) {
+    mem->unmap_queue = queue;
+    mem->unmap_done = std::make_shared<bool>(false);
+    queue->unmaps.push_back(mem->unmap_done);
+    if (event) *event = new _ecl_event{ECL_COMPLETE, mem->unmap_done};
+    return ECL_SUCCESS;
+}
+
+ecl_int eclGetEventInfo(ecl_event event, ecl_event_info, size_t, void *value, size_t *) {
+    memcpy(value, &event->status, sizeof(event->status));
+    return ECL_SUCCESS;
+}
+
+ecl_int eclReleaseEvent(ecl_event event) {
+    delete event;
+    return ECL_SUCCESS;
+}
+
+ecl_int eclReleaseCommandQueue(ecl_command_queue queue) {
+    delete queue;
+    return ECL_SUCCESS;
+}
+
+ecl_int eclReleaseMemObject(ecl_mem mem) {
+    if (mem->destructor) mem->destructor(mem, mem->user_data);
+    delete mem;
+    return ECL_SUCCESS;
+}
+
+ecl_int eclReleaseKernel(ecl_kernel kernel) {
+    delete kernel;
+    return ECL_SUCCESS;
+}
+
+ecl_int eclReleaseProgram(ecl_program) { return ECL_SUCCESS; }
+
+ecl_int eclReleaseContext(ecl_context) { return ECL_SUCCESS; }
+
+}  // extern "C"
@@ -0,0 +1,210 @@
+// Copyright 2019-2022 RnD Center "ELVEES", JSC
+// Host-side inspection of DSP ELF files before they are uploaded
+#ifndef _ELF_INSPECT_H
+#define _ELF_INSPECT_H
+
+#include <algorithm>
+#include <cstring>
+#include <set>
+#include <string>
+#include <vector>
+
+#include <elf.h>
+
+struct ElfSection {
+    std::string name;
+    uint64_t addr;
+    uint64_t size;
+    bool nobits;  // occupies DSP memory but not the file, e.g. .bss
+};
+
+struct ElfInfo {
+    std::vector<ElfSection> alloc_sections;  // sections loaded to DSP memory
+    std::set<std::string> symbols;
+    std::vector<char> upload;  // ELF image without debug information
+};
+
+struct Elf32Types {
+    typedef Elf32_Ehdr Ehdr;
+    typedef Elf32_Phdr Phdr;
+    typedef Elf32_Shdr Shdr;
+    typedef Elf32_Sym Sym;
+};
+
+struct Elf64Types {
+    typedef Elf64_Ehdr Ehdr;
+    typedef Elf64_Phdr Phdr;
+    typedef Elf64_Shdr Shdr;
+    typedef Elf64_Sym Sym;
+};
+
+static bool elf_in_bounds(const std::vector<char> &buf, uint64_t offset, uint64_t size) {
+    return offset <= buf.size() && size <= buf.size() - offset;
+}
+
+// Debug sections are never needed by the loader, the symbol table is kept since kernels are
+// looked up by name
+static bool elf_is_debug_section(const std::string &name) {
+    return name.compare(0, 7, ".debug_") == 0 || name.compare(0, 8, ".zdebug_") == 0 ||
+           name == ".line" || name.compare(0, 5, ".stab") == 0;
+}
+
+// Copy `buf` into `info.upload` without the file contents of debug sections. Their headers
+// become SHT_NOBITS so that section indices referenced from symbols and links stay valid.
+// Data following a removed range is moved back by a multiple of the largest alignment of
+// whatever lies after it, so file offsets keep their alignment.
+template <typename T>
+static void elf_strip_debug(const std::vector<char> &buf, ElfInfo &info,
+                            const std::vector<bool> &removed) {
+    const typename T::Ehdr *ehdr = reinterpret_cast<const typename T::Ehdr *>(buf.data());
+    const typename T::Shdr *shdrs =
+        reinterpret_cast<const typename T::Shdr *>(buf.data() + ehdr->e_shoff);
+    const typename T::Phdr *phdrs =
+        reinterpret_cast<const typename T::Phdr *>(buf.data() + ehdr->e_phoff);
+
+    struct Range {
+        uint64_t begin, end, shift;
+    };
+    std::vector<Range> ranges;
+    for (int i = 0; i < ehdr->e_shnum; ++i)
+        if (removed[i] && shdrs[i].sh_size)
+            ranges.push_back({shdrs[i].sh_offset, shdrs[i].sh_offset + shdrs[i].sh_size, 0});
+    std::sort(ranges.begin(), ranges.end(),
+              [](const Range &a, const Range &b) { return a.begin < b.begin; });
+    std::vector<Range> merged;
+    for (auto &r : ranges) {
+        if (!merged.empty() && r.begin <= merged.back().end)
+            merged.back().end = std::max(merged.back().end, r.end);
+        else
+            merged.push_back(r);
+    }
+
+    auto align_after = [&](uint64_t offset) {
+        uint64_t align = 8;  // section and program header tables
+        for (int i = 0; i < ehdr->e_shnum; ++i)
+            if (!removed[i] && shdrs[i].sh_type != SHT_NOBITS && shdrs[i].sh_offset >= offset)
+                align = std::max<uint64_t>(align, shdrs[i].sh_addralign);
+        for (int i = 0; i < ehdr->e_phnum; ++i)
+            if (phdrs[i].p_offset >= offset)
+                align = std::max<uint64_t>(align, phdrs[i].p_align);
+        return align;
+    };
+    // How far data at `offset` moves back
+    auto shift_of = [&](uint64_t offset) {
+        uint64_t shift = 0;
+        for (auto &r : merged)
+            if (r.end <= offset) shift = r.shift;
+        return shift;
+    };
+
+    uint64_t shift = 0;
+    for (auto &r : merged) {
+        uint64_t align = align_after(r.end);
+        shift += (r.end - r.begin) / align * align;
+        r.shift = shift;
+    }
+
+    // The part of a removed range that can not be dropped without breaking alignment stays
+    // in the image as padding
+    info.upload.clear();
+    info.upload.reserve(buf.size() - shift);
+    uint64_t pos = 0, prev_shift = 0;
+    for (auto &r : merged) {
+        info.upload.insert(info.upload.end(), buf.begin() + pos,
+                           buf.begin() + r.end - (r.shift - prev_shift));
+        pos = r.end;
+        prev_shift = r.shift;
+    }
+    info.upload.insert(info.upload.end(), buf.begin() + pos, buf.end());
+
+    typename T::Ehdr *new_ehdr = reinterpret_cast<typename T::Ehdr *>(info.upload.data());
+    new_ehdr->e_shoff -= shift_of(ehdr->e_shoff);
+    new_ehdr->e_phoff -= shift_of(ehdr->e_phoff);
+    typename T::Phdr *new_phdrs =
+        reinterpret_cast<typename T::Phdr *>(info.upload.data() + new_ehdr->e_phoff);
+    for (int i = 0; i < ehdr->e_phnum; ++i)
+        new_phdrs[i].p_offset -= shift_of(phdrs[i].p_offset);
+    typename T::Shdr *new_shdrs =
+        reinterpret_cast<typename T::Shdr *>(info.upload.data() + new_ehdr->e_shoff);
+    for (int i = 0; i < ehdr->e_shnum; ++i) {
+        if (removed[i]) {
+            new_shdrs[i].sh_type = SHT_NOBITS;
+            new_shdrs[i].sh_offset -= shift_of(shdrs[i].sh_offset);
+        } else if (shdrs[i].sh_type != SHT_NOBITS) {
+            new_shdrs[i].sh_offset -= shift_of(shdrs[i].sh_offset);
+        }
+    }
+}
+
+template <typename T>
+static const char *inspect_elf_class(const std::vector<char> &buf, ElfInfo &info) {
+    if (!elf_in_bounds(buf, 0, sizeof(typename T::Ehdr))) return "truncated ELF header";
+    const typename T::Ehdr *ehdr = reinterpret_cast<const typename T::Ehdr *>(buf.data());
+    if (ehdr->e_shentsize != sizeof(typename T::Shdr) || ehdr->e_shnum == 0 ||
+        !elf_in_bounds(buf, ehdr->e_shoff, uint64_t(ehdr->e_shnum) * ehdr->e_shentsize))
+        return "no section header table";
+    if (ehdr->e_phnum &&
+        (ehdr->e_phentsize != sizeof(typename T::Phdr) ||
+         !elf_in_bounds(buf, ehdr->e_phoff, uint64_t(ehdr->e_phnum) * ehdr->e_phentsize)))
+        return "broken program header table";
+    const typename T::Shdr *shdrs =
+        reinterpret_cast<const typename T::Shdr *>(buf.data() + ehdr->e_shoff);
+    for (int i = 0; i < ehdr->e_shnum; ++i)
+        if (shdrs[i].sh_type != SHT_NOBITS &&
+            !elf_in_bounds(buf, shdrs[i].sh_offset, shdrs[i].sh_size))
+            return "section data out of file";
+    if (ehdr->e_shstrndx >= ehdr->e_shnum) return "no section name table";
+
+    const typename T::Shdr &shstrtab = shdrs[ehdr->e_shstrndx];
+    auto name_at = [&](const typename T::Shdr &strtab, uint64_t offset) {
+        if (offset >= strtab.sh_size) return std::string();
+        const char *s = buf.data() + strtab.sh_offset + offset;
+        return std::string(s, strnlen(s, strtab.sh_size - offset));
+    };
+
+    std::vector<bool> removed(ehdr->e_shnum, false);
+    for (int i = 1; i < ehdr->e_shnum; ++i) {
+        const typename T::Shdr &shdr = shdrs[i];
+        std::string name = name_at(shstrtab, shdr.sh_name);
+        if (shdr.sh_flags & SHF_ALLOC)
+            info.alloc_sections.push_back(
+                {name, shdr.sh_addr, shdr.sh_size, shdr.sh_type == SHT_NOBITS});
+        else if (shdr.sh_type != SHT_NOBITS && elf_is_debug_section(name))
+            removed[i] = true;
+
+        if (shdr.sh_type == SHT_SYMTAB || shdr.sh_type == SHT_DYNSYM) {
+            if (shdr.sh_link >= ehdr->e_shnum) return "broken symbol table";
+            const typename T::Shdr &strtab = shdrs[shdr.sh_link];
+            const typename T::Sym *syms =
+                reinterpret_cast<const typename T::Sym *>(buf.data() + shdr.sh_offset);
+            for (uint64_t j = 0; j < shdr.sh_size / sizeof(typename T::Sym); ++j)
+                if (syms[j].st_shndx != SHN_UNDEF && syms[j].st_name)
+                    info.symbols.insert(name_at(strtab, syms[j].st_name));
+        }
+    }
+    // Relocations against debug sections go away with them
+    for (int i = 1; i < ehdr->e_shnum; ++i)
+        if ((shdrs[i].sh_type == SHT_REL || shdrs[i].sh_type == SHT_RELA) &&
+            shdrs[i].sh_info < ehdr->e_shnum && removed[shdrs[i].sh_info])
+            removed[i] = true;
+
+    elf_strip_debug<T>(buf, info, removed);
+    return nullptr;
+}
+
+// Parse section and symbol tables of ELF image `buf`. Returns an error description or nullptr.
+static const char *inspect_elf(const std::vector<char> &buf, ElfInfo &info) {
+    if (!elf_in_bounds(buf, 0, EI_NIDENT) || memcmp(buf.data(), ELFMAG, SELFMAG) != 0)
+        return "not an ELF file";
+    if (buf[EI_DATA] != ELFDATA2LSB) return "unsupported byte order";
+    switch (buf[EI_CLASS]) {
+        case ELFCLASS32:
+            return inspect_elf_class<Elf32Types>(buf, info);
+        case ELFCLASS64:
+            return inspect_elf_class<Elf64Types>(buf, info);
+        default:
+            return "unsupported ELF class";
+    }
+}
+
+#endif /* elf-inspect.h */
@@ -0,0 +1,384 @@
+// Copyright 2019-2022 RnD Center "ELVEES", JSC
+// Host-side element-wise reduction of per-core output slices
+#ifndef _REDUCE_H
+#define _REDUCE_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+enum class ReduceOp { Sum, Min, Max, Concat };
+enum class ReduceType { Float32, Int16, Int32 };
+
+struct ReduceSpec {
+    bool enabled = false;
+    ReduceOp op = ReduceOp::Sum;
+    ReduceType type = ReduceType::Float32;
+    std::string output = "-";  // `-` prints values to stdout
+};
+
+static bool parse_reduce(const std::string str_reduce, ReduceSpec &spec) {
+    int colon_pos = str_reduce.find(':');
+    if (colon_pos == std::string::npos) return false;
+    std::string op = str_reduce.substr(0, colon_pos);
+    std::string type = str_reduce.substr(colon_pos + 1);
+
+    if (op == "sum")
+        spec.op = ReduceOp::Sum;
+    else if (op == "min")
+        spec.op = ReduceOp::Min;
+    else if (op == "max")
+        spec.op = ReduceOp::Max;
+    else if (op == "concat")
+        spec.op = ReduceOp::Concat;
+    else
+        return false;
+
+    if (type == "float32")
+        spec.type = ReduceType::Float32;
+    else if (type == "int16")
+        spec.type = ReduceType::Int16;
+    else if (type == "int32")
+        spec.type = ReduceType::Int32;
+    else
+        return false;
+
+    spec.enabled = true;
+    return true;
+}
+
+static size_t reduce_type_size(ReduceType type) {
+    return type == ReduceType::Int16 ? sizeof(int16_t) : sizeof(int32_t);
+}
+
+// Scalar addition wraps around like the vector instructions do
+template <typename T>
+static T wrap_add(T a, T b) {
+    typedef typename std::make_unsigned<T>::type U;
+    return T(U(U(a) + U(b)));
+}
+
+static float wrap_add(float a, float b) { return a + b; }
+
+// dst[i] = op(dst[i], src[i]) for i in [begin, n)
+template <typename T>
+static void reduce_scalar(ReduceOp op, T *dst, const T *src, size_t begin, size_t n) {
+    for (size_t i = begin; i < n; ++i) {
+        T a = dst[i], b = src[i];
+        dst[i] = op == ReduceOp::Min ? std::min(a, b)
+                                     : op == ReduceOp::Max ? std::max(a, b) : wrap_add(a, b);
+    }
+}
+
+// Vector operations used by the reduction loops. Wider instruction sets than the baseline of
+// the build are compiled with target attributes and selected at run time, so the default
+// build uses AVX2 on hosts that have it.
+#if defined(__x86_64__)
+#define REDUCE_TARGET(isa) __attribute__((target(isa)))
+
+template <typename T>
+struct Avx2Ops;
+
+template <>
+struct Avx2Ops<float> {
+    typedef __m256 vec;
+    enum { width = 8 };
+    REDUCE_TARGET("avx2") static vec load(const float *p) { return _mm256_loadu_ps(p); }
+    REDUCE_TARGET("avx2") static void store(float *p, vec v) { _mm256_storeu_ps(p, v); }
+    REDUCE_TARGET("avx2") static vec add(vec a, vec b) { return _mm256_add_ps(a, b); }
+    REDUCE_TARGET("avx2") static vec min(vec a, vec b) { return _mm256_min_ps(a, b); }
+    REDUCE_TARGET("avx2") static vec max(vec a, vec b) { return _mm256_max_ps(a, b); }
+};
+
+template <>
+struct Avx2Ops<int32_t> {
+    typedef __m256i vec;
+    enum { width = 8 };
+    REDUCE_TARGET("avx2") static vec load(const int32_t *p) {
+        return _mm256_loadu_si256((const __m256i *)p);
+    }
+    REDUCE_TARGET("avx2") static void store(int32_t *p, vec v) {
+        _mm256_storeu_si256((__m256i *)p, v);
+    }
+    REDUCE_TARGET("avx2") static vec add(vec a, vec b) { return _mm256_add_epi32(a, b); }
+    REDUCE_TARGET("avx2") static vec min(vec a, vec b) { return _mm256_min_epi32(a, b); }
+    REDUCE_TARGET("avx2") static vec max(vec a, vec b) { return _mm256_max_epi32(a, b); }
+};
+
+template <>
+struct Avx2Ops<int16_t> {
+    typedef __m256i vec;
+    enum { width = 16 };
+    REDUCE_TARGET("avx2") static vec load(const int16_t *p) {
+        return _mm256_loadu_si256((const __m256i *)p);
+    }
+    REDUCE_TARGET("avx2") static void store(int16_t *p, vec v) {
+        _mm256_storeu_si256((__m256i *)p, v);
+    }
+    REDUCE_TARGET("avx2") static vec add(vec a, vec b) { return _mm256_add_epi16(a, b); }
+    REDUCE_TARGET("avx2") static vec min(vec a, vec b) { return _mm256_min_epi16(a, b); }
+    REDUCE_TARGET("avx2") static vec max(vec a, vec b) { return _mm256_max_epi16(a, b); }
+};
+
+// Packed 32-bit min/max appeared in SSE4.1
+struct Sse41OpsInt32 {
+    typedef __m128i vec;
+    enum { width = 4 };
+    REDUCE_TARGET("sse4.1") static vec load(const int32_t *p) {
+        return _mm_loadu_si128((const __m128i *)p);
+    }
+    REDUCE_TARGET("sse4.1") static void store(int32_t *p, vec v) {
+        _mm_storeu_si128((__m128i *)p, v);
+    }
+    REDUCE_TARGET("sse4.1") static vec add(vec a, vec b) { return _mm_add_epi32(a, b); }
+    REDUCE_TARGET("sse4.1") static vec min(vec a, vec b) { return _mm_min_epi32(a, b); }
+    REDUCE_TARGET("sse4.1") static vec max(vec a, vec b) { return _mm_max_epi32(a, b); }
+};
+
+// SSE2 is the x86-64 baseline
+template <typename T>
+struct SimdOps;
+
+template <>
+struct SimdOps<float> {
+    typedef __m128 vec;
+    enum { width = 4 };
+    static vec load(const float *p) { return _mm_loadu_ps(p); }
+    static void store(float *p, vec v) { _mm_storeu_ps(p, v); }
+    static vec add(vec a, vec b) { return _mm_add_ps(a, b); }
+    static vec min(vec a, vec b) { return _mm_min_ps(a, b); }
+    static vec max(vec a, vec b) { return _mm_max_ps(a, b); }
+};
+
+template <>
+struct SimdOps<int16_t> {
+    typedef __m128i vec;
+    enum { width = 8 };
+    static vec load(const int16_t *p) { return _mm_loadu_si128((const __m128i *)p); }
+    static void store(int16_t *p, vec v) { _mm_storeu_si128((__m128i *)p, v); }
+    static vec add(vec a, vec b) { return _mm_add_epi16(a, b); }
+    static vec min(vec a, vec b) { return _mm_min_epi16(a, b); }
+    static vec max(vec a, vec b) { return _mm_max_epi16(a, b); }
+};
+#elif defined(__ARM_NEON)
+template <typename T>
+struct SimdOps;
+
+template <>
+struct SimdOps<float> {
+    typedef float32x4_t vec;
+    enum { width = 4 };
+    static vec load(const float *p) { return vld1q_f32(p); }
+    static void store(float *p, vec v) { vst1q_f32(p, v); }
+    static vec add(vec a, vec b) { return vaddq_f32(a, b); }
+    static vec min(vec a, vec b) { return vminq_f32(a, b); }
+    static vec max(vec a, vec b) { return vmaxq_f32(a, b); }
+};
+
+template <>
+struct SimdOps<int32_t> {
+    typedef int32x4_t vec;
+    enum { width = 4 };
+    static vec load(const int32_t *p) { return vld1q_s32(p); }
+    static void store(int32_t *p, vec v) { vst1q_s32(p, v); }
+    static vec add(vec a, vec b) { return vaddq_s32(a, b); }
+    static vec min(vec a, vec b) { return vminq_s32(a, b); }
+    static vec max(vec a, vec b) { return vmaxq_s32(a, b); }
+};
+
+template <>
+struct SimdOps<int16_t> {
+    typedef int16x8_t vec;
+    enum { width = 8 };
+    static vec load(const int16_t *p) { return vld1q_s16(p); }
+    static void store(int16_t *p, vec v) { vst1q_s16(p, v); }
+    static vec add(vec a, vec b) { return vaddq_s16(a, b); }
+    static vec min(vec a, vec b) { return vminq_s16(a, b); }
+    static vec max(vec a, vec b) { return vmaxq_s16(a, b); }
+};
+#endif
+
+#if defined(__x86_64__) || defined(__ARM_NEON)
+// The loop is repeated per instruction set since vector operations can only be inlined into
+// functions compiled for the same target
+template <typename V, typename T>
+static void reduce_vectors(ReduceOp op, T *dst, const T *src, size_t n) {
+    size_t i = 0;
+    for (; i + V::width <= n; i += V::width) {
+        typename V::vec a = V::load(dst + i), b = V::load(src + i);
+        V::store(dst + i, op == ReduceOp::Min ? V::min(a, b)
+                                              : op == ReduceOp::Max ? V::max(a, b) : V::add(a, b));
+    }
+    reduce_scalar(op, dst, src, i, n);
+}
+#endif
+
+#if defined(__x86_64__)
+template <typename V, typename T>
+REDUCE_TARGET("avx2") static void reduce_vectors_avx2(ReduceOp op, T *dst, const T *src, size_t n) {
+    size_t i = 0;
+    for (; i + V::width <= n; i += V::width) {
+        typename V::vec a = V::load(dst + i), b = V::load(src + i);
+        V::store(dst + i, op == ReduceOp::Min ? V::min(a, b)
+                                              : op == ReduceOp::Max ? V::max(a, b) : V::add(a, b));
+    }
+    reduce_scalar(op, dst, src, i, n);
+}
+
+template <typename V, typename T>
+REDUCE_TARGET("sse4.1")
+static void reduce_vectors_sse41(ReduceOp op, T *dst, const T *src, size_t n) {
+    size_t i = 0;
+    for (; i + V::width <= n; i += V::width) {
+        typename V::vec a = V::load(dst + i), b = V::load(src + i);
+        V::store(dst + i, op == ReduceOp::Min ? V::min(a, b)
+                                              : op == ReduceOp::Max ? V::max(a, b) : V::add(a, b));
+    }
+    reduce_scalar(op, dst, src, i, n);
+}
+
+static bool reduce_has_avx2() {
+    static const bool has = __builtin_cpu_supports("avx2");
+    return has;
+}
+
+static bool reduce_has_sse41() {
+    static const bool has = __builtin_cpu_supports("sse4.1");
+    return has;
+}
+
+// dst[i] = op(dst[i], src[i]) for i in [0, n)
+static void reduce_block(ReduceOp op, float *dst, const float *src, size_t n) {
+    if (reduce_has_avx2())
+        reduce_vectors_avx2<Avx2Ops<float> >(op, dst, src, n);
+    else
+        reduce_vectors<SimdOps<float> >(op, dst, src, n);
+}
+
+static void reduce_block(ReduceOp op, int16_t *dst, const int16_t *src, size_t n) {
+    if (reduce_has_avx2())
+        reduce_vectors_avx2<Avx2Ops<int16_t> >(op, dst, src, n);
+    else
+        reduce_vectors<SimdOps<int16_t> >(op, dst, src, n);
+}
+
+static void reduce_block(ReduceOp op, int32_t *dst, const int32_t *src, size_t n) {
+    if (reduce_has_avx2())
+        reduce_vectors_avx2<Avx2Ops<int32_t> >(op, dst, src, n);
+    else if (reduce_has_sse41())
+        reduce_vectors_sse41<Sse41OpsInt32>(op, dst, src, n);
+    else
+        reduce_scalar(op, dst, src, 0, n);
+}
+#elif defined(__ARM_NEON)
+template <typename T>
+static void reduce_block(ReduceOp op, T *dst, const T *src, size_t n) {
+    reduce_vectors<SimdOps<T> >(op, dst, src, n);
+}
+#else
+template <typename T>
+static void reduce_block(ReduceOp op, T *dst, const T *src, size_t n) {
+    reduce_scalar(op, dst, src, 0, n);
+}
+#endif
+
+// Reduce `nslices` slices of `count` elements located `stride` bytes apart into `result`.
+// The element range is split between threads, each of them walks all slices over its part.
+template <typename T>
+static void reduce_slices(ReduceOp op, const char *base, size_t stride, size_t nslices,
+                          size_t count, T *result) {
+    const size_t min_chunk = 64 * 1024;
+    size_t nthreads = std::max<size_t>(1, std::thread::hardware_concurrency());
+    nthreads = std::min(nthreads, std::max<size_t>(1, count / min_chunk));
+    // Keep chunk boundaries on cache lines
+    size_t chunk = ((count + nthreads - 1) / nthreads + 63) & ~size_t(63);
+
+    auto worker = [=](size_t begin, size_t end) {
+        std::copy(reinterpret_cast<const T *>(base) + begin,
+                  reinterpret_cast<const T *>(base) + end, result + begin);
+        for (size_t s = 1; s < nslices; ++s)
+            reduce_block(op, result + begin,
+                         reinterpret_cast<const T *>(base + s * stride) + begin, end - begin);
+    };
+
+    std::vector<std::thread> threads;
+    for (size_t begin = chunk; begin < count; begin += chunk)
+        threads.emplace_back(worker, begin, std::min(count, begin + chunk));
+    worker(0, std::min(count, chunk));
+    for (auto &t : threads)
+        t.join();
+}
+
+template <typename T>
+static void print_values(const T *data, size_t count, const char *format) {
+    for (size_t i = 0; i < count; ++i)
+        printf(format, data[i]);
+}
+
+static bool write_reduce_result(const ReduceSpec &spec, const void *data, size_t size) {
+    if (spec.output != "-") {
+        std::ofstream file(spec.output, std::ios::binary);
+        if (!file) return false;
+        file.write(reinterpret_cast<const char *>(data), size);
+        return file.good();
+    }
+
+    size_t count = size / reduce_type_size(spec.type);
+    switch (spec.type) {
+        case ReduceType::Float32:
+            print_values(reinterpret_cast<const float *>(data), count, "%g\n");
+            break;
+        case ReduceType::Int16:
+            print_values(reinterpret_cast<const int16_t *>(data), count, "%hd\n");
+            break;
+        case ReduceType::Int32:
+            print_values(reinterpret_cast<const int32_t *>(data), count, "%d\n");
+            break;
+    }
+    return true;
+}
+
+// Reduce per-core slices and write the result. Concatenation writes slices back to back.
+static bool run_reduce(const ReduceSpec &spec, const char *base, size_t stride, size_t nslices,
+                       size_t slice_size) {
+    size_t count = slice_size / reduce_type_size(spec.type);
+    size_t bytes = count * reduce_type_size(spec.type);
+    std::vector<char> result;
+
+    if (spec.op == ReduceOp::Concat) {
+        result.resize(nslices * bytes);
+        for (size_t s = 0; s < nslices; ++s)
+            std::copy(base + s * stride, base + s * stride + bytes, result.data() + s * bytes);
+        return write_reduce_result(spec, result.data(), result.size());
+    }
+
+    result.resize(bytes);
+    switch (spec.type) {
+        case ReduceType::Float32:
+            reduce_slices(spec.op, base, stride, nslices, count,
+                          reinterpret_cast<float *>(result.data()));
+            break;
+        case ReduceType::Int16:
+            reduce_slices(spec.op, base, stride, nslices, count,
+                          reinterpret_cast<int16_t *>(result.data()));
+            break;
+        case ReduceType::Int32:
+            reduce_slices(spec.op, base, stride, nslices, count,
+                          reinterpret_cast<int32_t *>(result.data()));
+            break;
+    }
+    return write_reduce_result(spec, result.data(), result.size());
+}
+
+#endif /* reduce.h */
@@ -0,0 +1,31 @@
+#!/bin/sh
+# Compare startup time of elcorecl-run with serial startup and with the startup task graph,
+# both built against the ElcoreCL stub (cmake -DELCORECL_RUN_STUB=ON). Usage:
+#   startup-bench.sh <build dir> [runs] -- <elcorecl-run arguments>
+# Driver latencies are set by ELCORECL_STUB_*_MS variables, see elcorecl-stub.cc.
+set -e
+
+if [ $# -lt 2 ]; then
+    echo "Usage: $0 <build dir> [runs] -- <elcorecl-run arguments>" >&2
+    exit 1
+fi
+build=$1
+shift
+runs=9
+if [ "$1" != "--" ]; then
+    runs=$1
+    shift
+fi
+[ "$1" = "--" ] && shift
+
+# Median of `runs` startup times in ms
+median() {
+    for i in $(seq "$runs"); do
+        "$@" 2>&1 >/dev/null | sed -n 's/^startup time=\(.*\) ms$/\1/p'
+    done | sort -n | awk '{ t[NR] = $1 } END { print t[int((NR + 1) / 2)] }'
+}
+
+serial=$(median "$build/elcorecl-run-stub-serial" "$@")
+graph=$(median "$build/elcorecl-run-stub" "$@")
+echo "$serial $graph" | awk '{ printf "startup: serial %.3f ms, task graph %.3f ms, saved %.3f ms\n",
+                                      $1, $2, $1 - $2 }'